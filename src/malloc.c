@@ -1,42 +1,672 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
 
-#define ALIGN4(s)         (((((s) - 1) >> 2) << 2) + 4)
+/* Payloads are aligned for any type, the alignment of max_align_t */
+#define ALIGNMENT         16
+#define ALIGN16(s)        (((((s) - 1) >> 4) << 4) + 16)
 #define BLOCK_DATA(b)     ((b) + 1)
 #define BLOCK_HEADER(ptr) ((struct _block *)(ptr) - 1)
 
+/* Payload size for a request: header and payload together are a whole
+   number of ALIGNMENT units, so the payload after every header lands
+   aligned.  Payload sizes are 8 more than a multiple of 16. */
+#define REQUEST_SIZE(s)   (ALIGN16((s) + sizeof(struct _block)) - sizeof(struct _block))
+
+/* Sizes are multiples of 8, which leaves the low bits of the size word
+   for flags.  A _block's neighbours are found from its address: the next
+   one starts right after its payload, and a free _block repeats its size
+   in a footer at the end of its payload so the one after can find it. */
+#define BLOCK_INUSE       1UL      /* Handed out to the user                 */
+#define BLOCK_PREV_INUSE  2UL      /* The _block before is not free          */
+#define BLOCK_MMAPPED     4UL      /* Has a mapping of its own               */
+#define BLOCK_FLAGS       7UL
+#define BLOCK_SIZE(b)     ((b)->size & ~BLOCK_FLAGS)
+#define BLOCK_NEXT(b)     ((struct _block *)((char *)BLOCK_DATA(b) + BLOCK_SIZE(b)))
+#define BLOCK_FOOTER(b)   (((size_t *)BLOCK_NEXT(b))[-1])
+#define BLOCK_PREV(b)     ((struct _block *)((char *)(b) - ((size_t *)(b))[-1]) - 1)
+#define BLOCK_FREE(b)     ((struct _free *)BLOCK_DATA(b))
+
+#if defined TLSF && TLSF == 0
+/* Two-level segregated fit.  The first level splits sizes by power of two,
+   the second level splits each power of two into SL_INDEX_COUNT linear
+   sub-bins.  Sizes below SMALL_BLOCK_SIZE all live in first level 0. */
+#define SL_INDEX_COUNT_LOG2 5
+#define ALIGN_SIZE_LOG2     4
+#define SL_INDEX_COUNT      (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_MAX        38
+#define FL_INDEX_SHIFT      (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT      (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE    (1 << FL_INDEX_SHIFT)
+#endif
+
+/* Free blocks must be able to hold their bookkeeping and footer */
+#define MIN_BLOCK_SIZE      REQUEST_SIZE(sizeof(struct _free) + sizeof(size_t))
+
+/* Requests up to SLAB_MAX_SIZE bytes are served from page sized slabs of
+   equal slots instead of _blocks.  Build with -DSLAB_MAX_SIZE=0 to turn
+   the slab layer off. */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE       256
+#endif
+#define SLAB_SIZE           4096
+#define SLAB_HEADER_SIZE    64
+#define SLAB_CLASS_COUNT    12
+#define SLAB_BITMAP_WORDS   (SLAB_SIZE / 16 / 64)
+#define SLAB_REGION_SIZE    (1UL << 30)  /* Address space reserved for slabs */
+
+/* Each thread allocates from one of up to MAX_ARENAS independent arenas.
+   The main arena grows with sbrk, the others carve _blocks out of
+   REGION_SIZE aligned mmap regions, so any _block outside the sbrk heap
+   finds its arena by masking its address down to the segment header. */
+#define MAX_ARENAS          64
+#define ARENAS_PER_CPU      4
+#define REGION_SIZE         (64UL << 20)
+#define SEGMENT_HEADER_SIZE 24       /* Puts the first payload on ALIGNMENT */
+#define REGION_BLOCK_MAX    (REGION_SIZE - SEGMENT_HEADER_SIZE - 2 * sizeof(struct _block))
+
+/* The main arena's top chunk grows geometrically between these sizes */
+#define HEAP_GROW_MIN       (64 * 1024)
+#define HEAP_GROW_MAX       (32UL << 20)
+
 /* Flags to manage allocation tracking */
 static bool first_allocation = true;       // To skip the first growHeap call
 static bool in_printStatistics = false;    // To prevent tracking during printStatistics
 
 static int atexit_registered = 0;
-static int num_mallocs       = 0;
-static int num_frees         = 0;
-static int num_reuses        = 0;
-static int num_grows         = 0;
-static int num_splits        = 0;
-static int num_coalesces     = 0;
-static int num_blocks        = 0;
-static int num_requested     = 0;
-static int max_heap          = 0;
 
 struct _block 
 {
-   size_t  size;         /* Size of the allocated _block of memory in bytes     */
-   struct _block *next;  /* Pointer to the next _block of allocated memory      */
-   struct _block *prev;  /* Pointer to the previous _block of allocated memory  */
-   bool   free;          /* Is this _block free?                                */
-   char   padding[3];    /* Padding to align the structure                      */
+   size_t  size;         /* Payload size in bytes, BLOCK_* flags in the low bits */
+};
+
+/* Bookkeeping of a free _block.  It lives at the start of the free
+   _block's payload, so it costs nothing once the _block is handed out. */
+struct _free
+{
+#if defined TLSF && TLSF == 0
+   struct _block *next_free;   /* Links in the _block's TLSF bin           */
+   struct _block *prev_free;
+#endif
+   uint32_t freed_at;          /* purge_epoch when this _block became free */
+   bool     purged;            /* Were this _block's pages given back?     */
+};
+
+/* A slab is one page carved into equal slots of a single size class.
+   The header sits at the start of the page, so a slot finds its slab by
+   masking its address and needs no header of its own. */
+struct _slab
+{
+   struct _slab *next;       /* Next slab of this class with a free slot  */
+   struct _slab *prev;       /* Previous slab of this class               */
+   struct _arena *arena;     /* Arena whose lock guards this slab         */
+   uint16_t slot_size;       /* Size of every slot in bytes               */
+   uint16_t slot_count;      /* Number of slots carved from this slab     */
+   uint16_t free_count;      /* Number of slots not handed out            */
+   uint16_t size_class;      /* Index into slab_class_size                */
+   uint64_t bitmap[SLAB_BITMAP_WORDS]; /* Set bits are free slots         */
 };
 
-struct _block *heapList = NULL; /* Free list to track the _blocks available */
-struct _block *last_allocated = NULL; // For Next Fit implementation
-static void *heap_start = NULL;  // Track start of heap
+/* An arena is a self contained heap.  Everything in it, statistics
+   included, is guarded by its lock. */
+struct _arena
+{
+   pthread_mutex_t lock;
+   struct _segment *segments;      /* Segments of this arena, oldest first  */
+   struct _segment *segment_last;  /* Segment holding the top chunk         */
+   struct _block *last_allocated;  /* For Next Fit implementation           */
+   char *region_top;               /* Top chunk: grown but never carved     */
+   char *region_end;
+   size_t grow_size;               /* Size of the next sbrk                 */
+
+#if defined TLSF && TLSF == 0
+   uint32_t fl_bitmap;                               /* Non-empty first levels  */
+   uint32_t sl_bitmap[FL_INDEX_COUNT];               /* Non-empty second levels */
+   struct _block *tlsf_bins[FL_INDEX_COUNT][SL_INDEX_COUNT];
+#endif
+
+   struct _slab *slab_partial[SLAB_CLASS_COUNT];     /* Slabs with space        */
+   struct _slab *slab_empty;                         /* Wholly free slabs       */
+
+   int num_mallocs;
+   int num_frees;
+   int num_reuses;
+   int num_grows;
+   int num_splits;
+   int num_coalesces;
+   int num_blocks;
+   int num_requested;
+   size_t heap_size;               /* Bytes of _blocks carved, headers too  */
+   int max_heap;
+   int num_slabs;
+   int num_purges;
+   int num_mmaps;
+};
+
+/* A segment is a run of _blocks contiguous in memory: one per mmap
+   region, and one per stretch of sbrk heap not interrupted by somebody
+   else's sbrk.  The header sits at the segment base and the _blocks end
+   at a fence, a zero sized in-use header that no _block coalesces into.
+   The top chunk's own header serves as the fence of the newest segment. */
+struct _segment
+{
+   struct _arena   *arena;         /* Owner, read by masking for regions    */
+   struct _segment *next;          /* Next newer segment of the arena       */
+   struct _block   *end;           /* Fence ending this segment's _blocks   */
+};
+
+#define SEGMENT_FIRST(s)  ((struct _block *)((char *)(s) + SEGMENT_HEADER_SIZE))
+
+static struct _arena arenas[MAX_ARENAS] =
+   { [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+static int num_arenas = 1;          /* Set from the CPU count on first malloc */
+static unsigned next_arena = 0;     /* Round-robin cursor for new threads     */
+static __thread struct _arena *thread_arena
+   __attribute__((tls_model("initial-exec")));
+
+/* Background purging, off unless MALLOC_DECAY_MS is set.  The purger
+   thread bumps purge_epoch every tick and gives back the pages of free
+   _blocks that have sat unused for PURGE_DECAY_TICKS ticks. */
+#define PURGE_DECAY_TICKS   4
+static int purge_tick_ms = 0;
+static int purge_advice = MADV_DONTNEED;
+static uint32_t purge_epoch = 0;
+static int purger_started = 0;
+
+/* Requests of at least mmap_threshold bytes bypass the arenas and get
+   a mapping of their own that free() unmaps straight away */
+#define DEFAULT_MMAP_THRESHOLD  (128 * 1024)
+
+/* A mapped _block's header sits one word into the mapping, or further
+   for aligned requests, and the word before it holds that distance */
+#define MMAP_HEADER_SIZE        16
+#define MMAP_OFFSET(b)          (((size_t *)(b))[-1])
+#define MMAP_START(b)           ((char *)(b) - MMAP_OFFSET(b))
+#define MMAP_LENGTH(b)          (MMAP_OFFSET(b) + sizeof(struct _block) + BLOCK_SIZE(b))
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+
+static char *heap_start = NULL;     /* sbrk range owned by the main arena     */
+static char *heap_end   = NULL;
+
+/*
+ * \brief arenaAcquire
+ *
+ * Locks the calling thread's arena.  A thread is handed an arena
+ * round-robin on its first allocation.  If that arena is busy the thread
+ * moves to the first idle one it finds and only blocks when every arena
+ * is busy, so threads spread out according to contention.
+ *
+ * \return the locked arena
+ */
+static struct _arena *arenaAcquire(void)
+{
+   struct _arena *a = thread_arena;
+
+   if (a == NULL)
+   {
+      unsigned n = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+      a = thread_arena = &arenas[n % num_arenas];
+   }
+
+   if (pthread_mutex_trylock(&a->lock) == 0)
+   {
+      return a;
+   }
+
+   int start = (int)(a - arenas);
+   for (int i = 1; i < num_arenas; i++)
+   {
+      struct _arena *other = &arenas[(start + i) % num_arenas];
+      if (pthread_mutex_trylock(&other->lock) == 0)
+      {
+         thread_arena = other;
+         return other;
+      }
+   }
+
+   pthread_mutex_lock(&a->lock);
+   return a;
+}
+
+/*
+ * \brief blockArena
+ *
+ * \return the arena a _block was carved from
+ */
+static struct _arena *blockArena(struct _block *b)
+{
+   char *start = __atomic_load_n(&heap_start, __ATOMIC_ACQUIRE);
+   char *end   = __atomic_load_n(&heap_end, __ATOMIC_ACQUIRE);
+
+   if ((char *)b >= start && (char *)b < end)
+   {
+      return &arenas[0];
+   }
+   return ((struct _segment *)((uintptr_t)b & ~(REGION_SIZE - 1)))->arena;
+}
+
+/*
+ * \brief arenaFirst
+ *
+ * \return the lowest _block of the arena's oldest segment with any, or
+ * NULL if nothing has been carved yet
+ */
+static struct _block *arenaFirst(struct _arena *a)
+{
+   for (struct _segment *seg = a->segments; seg; seg = seg->next)
+   {
+      if (SEGMENT_FIRST(seg) != seg->end)
+      {
+         return SEGMENT_FIRST(seg);
+      }
+   }
+   return NULL;
+}
+
+/*
+ * \brief arenaNext
+ *
+ * Steps to the _block after b in address order, moving on to the next
+ * segment when b is the last before its segment's fence.
+ *
+ * \return the next _block or NULL after the last _block of the arena
+ */
+static struct _block *arenaNext(struct _arena *a, struct _block *b)
+{
+   struct _block *next = BLOCK_NEXT(b);
+   if (BLOCK_SIZE(next) != 0)
+   {
+      return next;
+   }
+
+   struct _segment *seg = a->segments;
+   while (seg->end != next)
+   {
+      seg = seg->next;
+   }
+   for (seg = seg->next; seg; seg = seg->next)
+   {
+      if (SEGMENT_FIRST(seg) != seg->end)
+      {
+         return SEGMENT_FIRST(seg);
+      }
+   }
+   return NULL;
+}
+
+#if defined TLSF && TLSF == 0
+/*
+ * \brief tlsfMapping
+ *
+ * Computes the first and second level index of the bin holding
+ * free _blocks of the given size.
+ */
+static void tlsfMapping(size_t size, int *fl, int *sl)
+{
+   if (size < SMALL_BLOCK_SIZE)
+   {
+      *fl = 0;
+      *sl = (int)(size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT));
+      return;
+   }
+
+   int f = 63 - __builtin_clzl(size);
+   *sl = (int)(size >> (f - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+   *fl = f - (FL_INDEX_SHIFT - 1);
+
+   /* Anything past the last class shares the last bin */
+   if (*fl >= FL_INDEX_COUNT)
+   {
+      *fl = FL_INDEX_COUNT - 1;
+      *sl = SL_INDEX_COUNT - 1;
+   }
+}
+
+/*
+ * \brief tlsfInsert
+ *
+ * Pushes a free _block onto the head of its bin and marks the bin
+ * as non-empty in both bitmaps.
+ */
+static void tlsfInsert(struct _arena *a, struct _block *b)
+{
+   int fl, sl;
+   tlsfMapping(BLOCK_SIZE(b), &fl, &sl);
+
+   struct _block *head = a->tlsf_bins[fl][sl];
+   BLOCK_FREE(b)->next_free = head;
+   BLOCK_FREE(b)->prev_free = NULL;
+   if (head)
+   {
+      BLOCK_FREE(head)->prev_free = b;
+   }
+   a->tlsf_bins[fl][sl] = b;
+
+   a->fl_bitmap     |= 1U << fl;
+   a->sl_bitmap[fl] |= 1U << sl;
+}
+
+/*
+ * \brief tlsfRemove
+ *
+ * Unlinks a free _block from its bin, clearing the bitmap bits when
+ * the bin becomes empty.
+ */
+static void tlsfRemove(struct _arena *a, struct _block *b)
+{
+   int fl, sl;
+   tlsfMapping(BLOCK_SIZE(b), &fl, &sl);
+
+   struct _block *next = BLOCK_FREE(b)->next_free;
+   struct _block *prev = BLOCK_FREE(b)->prev_free;
+   if (next)
+   {
+      BLOCK_FREE(next)->prev_free = prev;
+   }
+   if (prev)
+   {
+      BLOCK_FREE(prev)->next_free = next;
+   }
+   else
+   {
+      a->tlsf_bins[fl][sl] = next;
+      if (next == NULL)
+      {
+         a->sl_bitmap[fl] &= ~(1U << sl);
+         if (a->sl_bitmap[fl] == 0)
+         {
+            a->fl_bitmap &= ~(1U << fl);
+         }
+      }
+   }
+}
+
+/*
+ * \brief tlsfSearch
+ *
+ * Rounds the request up to the next bin boundary so that every _block in
+ * the chosen bin fits, then uses the bitmaps to find the first non-empty
+ * bin at or above it.
+ *
+ * \return the head of that bin or NULL if no bin can satisfy the request
+ */
+static struct _block *tlsfSearch(struct _arena *a, size_t size)
+{
+   if (size >= SMALL_BLOCK_SIZE)
+   {
+      size += (1UL << (63 - __builtin_clzl(size) - SL_INDEX_COUNT_LOG2)) - 1;
+   }
+   if (size >> FL_INDEX_MAX)
+   {
+      return NULL;
+   }
+
+   int fl, sl;
+   tlsfMapping(size, &fl, &sl);
+
+   uint32_t sl_map = a->sl_bitmap[fl] & (~0U << sl);
+   if (sl_map == 0)
+   {
+      /* Nothing left on this level, take the next non-empty one */
+      uint32_t fl_map = (fl + 1 < 32) ? a->fl_bitmap & (~0U << (fl + 1)) : 0;
+      if (fl_map == 0)
+      {
+         return NULL;
+      }
+      fl = __builtin_ctz(fl_map);
+      sl_map = a->sl_bitmap[fl];
+   }
+   sl = __builtin_ctz(sl_map);
+
+   return a->tlsf_bins[fl][sl];
+}
+#endif
+
+/*
+ * \brief freeListInsert
+ *
+ * Records a _block that has just become free in the strategy's index.
+ * The list based strategies find free _blocks by walking the arena's
+ * segments and need no index.
+ */
+static void freeListInsert(struct _arena *a, struct _block *b)
+{
+#if defined TLSF && TLSF == 0
+   tlsfInsert(a, b);
+#else
+   (void)a;
+   (void)b;
+#endif
+}
+
+/*
+ * \brief freeListRemove
+ *
+ * Drops a free _block from the strategy's index before it is allocated
+ * or merged into a neighbour.
+ */
+static void freeListRemove(struct _arena *a, struct _block *b)
+{
+#if defined TLSF && TLSF == 0
+   tlsfRemove(a, b);
+#else
+   (void)a;
+   (void)b;
+#endif
+}
+
+static const uint16_t slab_class_size[SLAB_CLASS_COUNT] =
+   { 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256 };
+
+/* The slab reservation is shared by all arenas, pages are handed out
+   under slab_lock */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *slab_region = NULL;    /* Reserved range all slabs come from  */
+static char *slab_brk    = NULL;    /* First never used page of the range  */
+
+/*
+ * \brief slabClass
+ *
+ * \return the smallest size class holding size bytes
+ */
+static int slabClass(size_t size)
+{
+   if (size <= 128)
+   {
+      return (int)((size + 15) / 16) - 1;
+   }
+   return 7 + (int)((size - 128 + 31) / 32);
+}
+
+/*
+ * \brief slabOwns
+ *
+ * \return true if ptr was handed out by the slab layer
+ */
+static bool slabOwns(void *ptr)
+{
+   char *region = __atomic_load_n(&slab_region, __ATOMIC_ACQUIRE);
+   return region && (uintptr_t)ptr - (uintptr_t)region < SLAB_REGION_SIZE;
+}
+
+/*
+ * \brief slabOf
+ *
+ * \return the slab holding the slot at ptr
+ */
+static struct _slab *slabOf(void *ptr)
+{
+   return (struct _slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/*
+ * \brief slabNew
+ *
+ * Takes a page from the arena's empty slab pool, or from the reserved
+ * region if the pool is dry, and carves it into slots for size class cls.
+ *
+ * \return the new slab or NULL if the region is used up
+ */
+static struct _slab *slabNew(struct _arena *a, int cls)
+{
+   struct _slab *slab = a->slab_empty;
+
+   if (slab)
+   {
+      a->slab_empty = slab->next;
+   }
+   else
+   {
+      pthread_mutex_lock(&slab_lock);
+      if (slab_region == NULL)
+      {
+         char *region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                             -1, 0);
+         if (region != MAP_FAILED)
+         {
+            slab_brk = region;
+            __atomic_store_n(&slab_region, region, __ATOMIC_RELEASE);
+         }
+      }
+      if (slab_region && slab_brk < slab_region + SLAB_REGION_SIZE)
+      {
+         slab = (struct _slab *)slab_brk;
+         slab_brk += SLAB_SIZE;
+      }
+      pthread_mutex_unlock(&slab_lock);
+
+      if (slab == NULL)
+      {
+         return NULL;
+      }
+      slab->arena = a;
+      a->num_slabs++;
+   }
+
+   slab->slot_size  = slab_class_size[cls];
+   slab->slot_count = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->slot_size;
+   slab->free_count = slab->slot_count;
+   slab->size_class = cls;
+
+   memset(slab->bitmap, 0, sizeof(slab->bitmap));
+   for (int i = 0; i < slab->slot_count; i++)
+   {
+      slab->bitmap[i / 64] |= 1UL << (i % 64);
+   }
+
+   slab->prev = NULL;
+   slab->next = a->slab_partial[cls];
+   if (slab->next)
+   {
+      slab->next->prev = slab;
+   }
+   a->slab_partial[cls] = slab;
+
+   return slab;
+}
+
+/*
+ * \brief slabAlloc
+ *
+ * Hands out the first free slot of the first slab in the arena with
+ * room in the size class for size.
+ *
+ * \return the slot or NULL if no slab could be had
+ */
+static void *slabAlloc(struct _arena *a, size_t size)
+{
+   int cls = slabClass(size);
+   struct _slab *slab = a->slab_partial[cls];
+
+   if (slab == NULL)
+   {
+      slab = slabNew(a, cls);
+      if (slab == NULL)
+      {
+         return NULL;
+      }
+   }
+
+   int word = 0;
+   while (slab->bitmap[word] == 0)
+   {
+      word++;
+   }
+   int slot = word * 64 + __builtin_ctzl(slab->bitmap[word]);
+   slab->bitmap[word] &= ~(1UL << (slot % 64));
+
+   /* A full slab leaves the partial list until a slot comes back */
+   if (--slab->free_count == 0)
+   {
+      a->slab_partial[cls] = slab->next;
+      if (slab->next)
+      {
+         slab->next->prev = NULL;
+      }
+   }
+
+   return (char *)slab + SLAB_HEADER_SIZE + (size_t)slot * slab->slot_size;
+}
+
+/*
+ * \brief slabFree
+ *
+ * Returns a slot to its slab, whose arena must be locked.  A full slab
+ * goes back on its partial list, and a slab with every slot free goes to
+ * the empty pool so any size class can reuse the page.
+ */
+static void slabFree(struct _arena *a, void *ptr)
+{
+   struct _slab *slab = slabOf(ptr);
+   int cls  = slab->size_class;
+   int slot = (int)(((char *)ptr - (char *)slab - SLAB_HEADER_SIZE) / slab->slot_size);
+
+   assert(!(slab->bitmap[slot / 64] & (1UL << (slot % 64))));
+   slab->bitmap[slot / 64] |= 1UL << (slot % 64);
+
+   if (slab->free_count++ == 0)
+   {
+      slab->prev = NULL;
+      slab->next = a->slab_partial[cls];
+      if (slab->next)
+      {
+         slab->next->prev = slab;
+      }
+      a->slab_partial[cls] = slab;
+   }
+
+   /* Keep one empty slab per class around to avoid churning pages */
+   if (slab->free_count == slab->slot_count &&
+       (slab->prev || slab->next))
+   {
+      if (slab->prev)
+      {
+         slab->prev->next = slab->next;
+      }
+      else
+      {
+         a->slab_partial[cls] = slab->next;
+      }
+      if (slab->next)
+      {
+         slab->next->prev = slab->prev;
+      }
+      slab->next = a->slab_empty;
+      a->slab_empty = slab;
+   }
+}
 
 /*
  *  \brief printStatistics
@@ -53,34 +683,65 @@ void printStatistics( void )
     /* Set the flag to indicate we're in printStatistics */
     in_printStatistics = true;
 
-    printf("\nheap management statistics\n");
-    printf("mallocs:\t%d\n", num_mallocs);
-    printf("frees:\t\t%d\n", num_frees );
-    printf("reuses:\t\t%d\n", num_reuses );
-    printf("grows:\t\t%d\n", num_grows );
-    printf("splits:\t\t%d\n", num_splits );
-    printf("coalesces:\t%d\n", num_coalesces );
-    printf("blocks:\t\t%d\n", num_blocks);
-    printf("requested:\t%d\n", num_requested);
-    printf("max heap:\t%d\n", max_heap);
+    /* Sum the arenas first, printf below allocates and needs the locks */
+    int num_mallocs = 0, num_frees = 0, num_reuses = 0, num_grows = 0;
+    int num_splits = 0, num_coalesces = 0, num_blocks = 0;
+    int num_requested = 0, max_heap = 0, num_slabs = 0, num_purges = 0;
+    int num_mmaps = 0;
 
     // Calculate fragmentation and count free blocks
     size_t total_free = 0;
     size_t largest_free = 0;
-    struct _block *curr = heapList;
-    while (curr)
+
+    for (int i = 0; i < num_arenas; i++)
     {
-        if (curr->free)
+        struct _arena *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+
+        num_mallocs   += a->num_mallocs;
+        num_frees     += a->num_frees;
+        num_reuses    += a->num_reuses;
+        num_grows     += a->num_grows;
+        num_splits    += a->num_splits;
+        num_coalesces += a->num_coalesces;
+        num_blocks    += a->num_blocks;
+        num_requested += a->num_requested;
+        max_heap      += a->max_heap;
+        num_slabs     += a->num_slabs;
+        num_purges    += a->num_purges;
+        num_mmaps     += a->num_mmaps;
+
+        struct _block *curr = arenaFirst(a);
+        while (curr)
         {
-            total_free += curr->size;
-            if (curr->size > largest_free)
+            if (!(curr->size & BLOCK_INUSE))
             {
-                largest_free = curr->size;
+                total_free += BLOCK_SIZE(curr);
+                if (BLOCK_SIZE(curr) > largest_free)
+                {
+                    largest_free = BLOCK_SIZE(curr);
+                }
             }
+            curr = arenaNext(a, curr);
         }
-        curr = curr->next;
+
+        pthread_mutex_unlock(&a->lock);
     }
 
+    printf("\nheap management statistics\n");
+    printf("mallocs:\t%d\n", num_mallocs);
+    printf("frees:\t\t%d\n", num_frees );
+    printf("reuses:\t\t%d\n", num_reuses );
+    printf("grows:\t\t%d\n", num_grows );
+    printf("splits:\t\t%d\n", num_splits );
+    printf("coalesces:\t%d\n", num_coalesces );
+    printf("blocks:\t\t%d\n", num_blocks);
+    printf("requested:\t%d\n", num_requested);
+    printf("max heap:\t%d\n", max_heap);
+    printf("slabs:\t\t%d\n", num_slabs);
+    printf("purges:\t\t%d\n", num_purges);
+    printf("mmaps:\t\t%d\n", num_mmaps);
+
     double fragmentation = 0;
     if (total_free > 0)
     {
@@ -96,10 +757,198 @@ void printStatistics( void )
     in_printStatistics = false;
 }
 
+/*
+ * \brief purgeBlock
+ *
+ * Gives the whole pages inside a free _block back to the OS.  The
+ * bookkeeping at the start of the payload and the footer at its end are
+ * kept.  The address range stays mapped and faults back in on reuse.
+ */
+static void purgeBlock(struct _arena *a, struct _block *b)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   uintptr_t start = (uintptr_t)BLOCK_FREE(b) + sizeof(struct _free);
+   uintptr_t end   = (uintptr_t)&BLOCK_FOOTER(b);
+
+   start = (start + page - 1) & ~(uintptr_t)(page - 1);
+   end   = end & ~(uintptr_t)(page - 1);
+
+   if (end > start && madvise((void *)start, end - start, purge_advice) == 0)
+   {
+      a->num_purges++;
+   }
+   BLOCK_FREE(b)->purged = true;
+}
+
+/*
+ * \brief purgeArena
+ *
+ * Purges every free _block of an arena that has been idle for the decay
+ * time.  Busy arenas are skipped and caught on a later tick rather than
+ * making their threads wait on the purger.
+ */
+static void purgeArena(struct _arena *a, uint32_t epoch)
+{
+   if (pthread_mutex_trylock(&a->lock) != 0)
+   {
+      return;
+   }
+
+   for (struct _block *curr = arenaFirst(a); curr; curr = arenaNext(a, curr))
+   {
+      if (!(curr->size & BLOCK_INUSE) && !BLOCK_FREE(curr)->purged &&
+          epoch - BLOCK_FREE(curr)->freed_at >= PURGE_DECAY_TICKS)
+      {
+         purgeBlock(a, curr);
+      }
+   }
+
+   pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * \brief purgerMain
+ *
+ * Body of the background purger thread.
+ */
+static void *purgerMain(void *arg)
+{
+   struct timespec tick = { purge_tick_ms / 1000,
+                            (purge_tick_ms % 1000) * 1000000L };
+   (void)arg;
+
+   for (;;)
+   {
+      nanosleep(&tick, NULL);
+      uint32_t epoch = __atomic_add_fetch(&purge_epoch, 1, __ATOMIC_RELAXED);
+      for (int i = 0; i < num_arenas; i++)
+      {
+         purgeArena(&arenas[i], epoch);
+      }
+   }
+   return NULL;
+}
+
+/*
+ * \brief purgerStart
+ *
+ * Starts the purger on the first free() once decay is configured.  It
+ * is not started from mallocInit since pthread_create allocates.
+ */
+static void purgerStart(void)
+{
+   int expected = 0;
+   if (purge_tick_ms == 0 ||
+       !__atomic_compare_exchange_n(&purger_started, &expected, 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+   {
+      return;
+   }
+
+   pthread_t thread;
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (pthread_create(&thread, &attr, purgerMain, NULL) != 0)
+   {
+      purge_tick_ms = 0;
+   }
+   pthread_attr_destroy(&attr);
+}
+
+/*
+ * \brief forkPrepare
+ *
+ * Takes every allocator lock around fork() so the child never inherits
+ * an arena in the middle of an update.
+ */
+static void forkPrepare(void)
+{
+   for (int i = 0; i < num_arenas; i++)
+   {
+      pthread_mutex_lock(&arenas[i].lock);
+   }
+   pthread_mutex_lock(&slab_lock);
+}
+
+static void forkRelease(void)
+{
+   pthread_mutex_unlock(&slab_lock);
+   for (int i = num_arenas - 1; i >= 0; i--)
+   {
+      pthread_mutex_unlock(&arenas[i].lock);
+   }
+}
+
+/* The purger thread does not survive into the child, start a new one */
+static void forkChild(void)
+{
+   forkRelease();
+   purger_started = 0;
+}
+
+/*
+ * \brief mallocInit
+ *
+ * One time setup on the first malloc: sizes the arena table from the
+ * CPU count (or MALLOC_ARENAS), reads the purge settings, installs the
+ * fork handlers and registers printStatistics.  The flag is claimed first so that allocations made
+ * by atexit() itself do not recurse back in here.
+ */
+static void mallocInit(void)
+{
+   int expected = 0;
+   if (!__atomic_compare_exchange_n(&atexit_registered, &expected, 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+   {
+      return;
+   }
+
+   int n = get_nprocs() * ARENAS_PER_CPU;
+   char *env = getenv("MALLOC_ARENAS");
+   if (env && atoi(env) > 0)
+   {
+      n = atoi(env);
+   }
+   if (n < 1)
+   {
+      n = 1;
+   }
+   num_arenas = n < MAX_ARENAS ? n : MAX_ARENAS;
+
+   env = getenv("MALLOC_MMAP_THRESHOLD");
+   if (env)
+   {
+      mmap_threshold = strtoul(env, NULL, 0);
+   }
+
+   /* Idle free _blocks are purged after MALLOC_DECAY_MS, checked every
+      quarter of that.  MALLOC_PURGE=free lets the kernel reclaim lazily. */
+   env = getenv("MALLOC_DECAY_MS");
+   if (env && atoi(env) > 0)
+   {
+      purge_tick_ms = atoi(env) / PURGE_DECAY_TICKS;
+      if (purge_tick_ms < 1)
+      {
+         purge_tick_ms = 1;
+      }
+   }
+#ifdef MADV_FREE
+   env = getenv("MALLOC_PURGE");
+   if (env && strcmp(env, "free") == 0)
+   {
+      purge_advice = MADV_FREE;
+   }
+#endif
+
+   pthread_atfork(forkPrepare, forkRelease, forkChild);
+   atexit( printStatistics );
+}
+
 /*
  * \brief findFreeBlock
  *
- * \param last pointer to the linked list of free _blocks
+ * \param a the locked arena to search
  * \param size size of the _block needed in bytes 
  *
  * \return a _block that fits the request or NULL if no free _block matches
@@ -107,10 +956,14 @@ void printStatistics( void )
  * \TODO Implement Next Fit
  * \TODO Implement Best Fit
  * \TODO Implement Worst Fit
+ *
+ * The list based strategies walk the arena's _blocks in address order.
+ * With TLSF the search is constant time: the bitmaps lead straight to a
+ * bin whose _blocks all fit.
  */
-struct _block *findFreeBlock(struct _block **last, size_t size) 
+struct _block *findFreeBlock(struct _arena *a, size_t size) 
 {
-   struct _block *curr = heapList;
+   struct _block *curr = arenaFirst(a);
 
 #if defined FIT && FIT == 0
    /* First fit */
@@ -122,172 +975,498 @@ struct _block *findFreeBlock(struct _block **last, size_t size)
    // without finding a node or it ends pointing to a free node that has enough
    // space for the request.
    // 
-   while (curr && !(curr->free && curr->size >= size)) 
+   while (curr && !(!(curr->size & BLOCK_INUSE) && BLOCK_SIZE(curr) >= size)) 
+   {
+      curr  = arenaNext(a, curr);
+   }
+   return curr;
+#endif
+
+// \TODO Put your Best Fit code in this #ifdef block
+#if defined BEST && BEST == 0
+   /** \TODO Implement best fit here */
+   /* Best fit */
+   struct _block *best = NULL;
+   size_t min_size = (size_t)-1;  // Initialize to maximum possible size
+   while (curr)
+   {
+       if (!(curr->size & BLOCK_INUSE) && BLOCK_SIZE(curr) >= size)
+       {
+           if (BLOCK_SIZE(curr) < min_size) 
+           {
+               min_size = BLOCK_SIZE(curr);
+               best = curr;
+           }
+       }
+       curr = arenaNext(a, curr);
+   }
+   return best;
+#endif
+
+// \TODO Put your Worst Fit code in this #ifdef block
+#if defined WORST && WORST == 0
+   /** \TODO Implement worst fit here */
+   /* Worst fit */
+   struct _block *worst = NULL;
+   size_t max_size = 0;
+   while (curr)
+   {
+       if (!(curr->size & BLOCK_INUSE) && BLOCK_SIZE(curr) >= size)
+       {   
+           if (BLOCK_SIZE(curr) > max_size) 
+           {
+               max_size = BLOCK_SIZE(curr);
+               worst = curr;
+           }
+       }
+       curr = arenaNext(a, curr);
+   }
+   return worst;
+#endif
+
+// \TODO Put your Next Fit code in this #ifdef block
+#if defined NEXT && NEXT == 0
+   /** \TODO Implement next fit here */
+   /* Next fit */
+   if (!curr) {
+       return NULL;  // Empty heap
+   }
+   
+   /* Start from last allocated if it exists, otherwise start from beginning */
+   if (a->last_allocated) {
+       curr = arenaNext(a, a->last_allocated);
+       if (!curr) {
+           curr = arenaFirst(a);  // Wrap to beginning if at end
+       }
+   }
+
+   /* Save starting point */
+   struct _block *start = curr;
+   
+   /* Search once through the list */
+   do {
+       if (!(curr->size & BLOCK_INUSE) && BLOCK_SIZE(curr) >= size) {
+           a->last_allocated = curr;  // Update last allocated
+           return curr;
+       }
+       curr = arenaNext(a, curr);
+       if (!curr) {
+           curr = arenaFirst(a);  // Wrap around
+       }
+   } while (curr != start);
+
+   /* If we get here, we've searched the entire list and found nothing */
+   return NULL;
+#endif
+
+#if defined TLSF && TLSF == 0
+   /* Two-level segregated fit */
+   return tlsfSearch(a, size);
+#endif
+
+   return curr;
+}
+
+/*
+ * \brief heapResize
+ *
+ * Adjusts the arena's heap size, the bytes of headers and payloads of
+ * its _blocks, and its high-water mark.  Splitting and coalescing move
+ * bytes between headers and payloads without changing the total, so
+ * only carving from the top chunk and giving memory back call this.
+ */
+static void heapResize(struct _arena *a, ptrdiff_t bytes)
+{
+   a->heap_size += bytes;
+   if (a->heap_size > (size_t)a->max_heap)
+   {
+      a->max_heap = a->heap_size;
+   }
+}
+
+/*
+ * \brief blockSplit
+ *
+ * Marks a free _block, already out of the free index, in use for a
+ * request of size bytes.  The rest becomes a free _block of its own when
+ * it is big enough to be one.
+ */
+static void blockSplit(struct _arena *a, struct _block *b, size_t size)
+{
+   /* Check if block is large enough to split */
+   size_t remaining_size = BLOCK_SIZE(b) - size;
+   if (remaining_size >= sizeof(struct _block) + MIN_BLOCK_SIZE)
+   {
+      struct _block *new_block = (struct _block *)((char *)BLOCK_DATA(b) + size);
+
+      new_block->size = (remaining_size - sizeof(struct _block)) | BLOCK_PREV_INUSE;
+      BLOCK_FOOTER(new_block) = BLOCK_SIZE(new_block);
+      *BLOCK_FREE(new_block) = *BLOCK_FREE(b);
+      freeListInsert(a, new_block);
+
+      b->size = size | (b->size & BLOCK_PREV_INUSE);
+      a->num_splits++;
+      a->num_blocks++;
+   }
+
+   b->size |= BLOCK_INUSE;
+   BLOCK_NEXT(b)->size |= BLOCK_PREV_INUSE;
+}
+
+/*
+ * \brief blockRelease
+ *
+ * Gives an in-use _block back to its arena.  A free neighbour on either
+ * side is merged in, then the result gets its footer and goes into the
+ * free index.
+ */
+static void blockRelease(struct _arena *a, struct _block *curr)
+{
+    /* Coalesce with previous block first if it's free */
+   if (!(curr->size & BLOCK_PREV_INUSE))
+   {
+       struct _block *prev_block = BLOCK_PREV(curr);
+       freeListRemove(a, prev_block);
+       prev_block->size += sizeof(struct _block) + BLOCK_SIZE(curr);
+       if (a->last_allocated == curr) {
+           a->last_allocated = prev_block;
+       }
+       curr = prev_block;  // Move curr pointer to coalesced block
+       a->num_coalesces++;
+       a->num_blocks--;
+   }
+
+   /* Then coalesce with next block if it's free */
+   struct _block *next_block = BLOCK_NEXT(curr);
+   if (!(next_block->size & BLOCK_INUSE))
+   {
+       freeListRemove(a, next_block);
+       curr->size += sizeof(struct _block) + BLOCK_SIZE(next_block);
+       if (a->last_allocated == next_block) {
+           a->last_allocated = curr;
+       }
+       a->num_coalesces++;
+       a->num_blocks--;
+   }
+
+   curr->size &= ~BLOCK_INUSE;
+   BLOCK_FOOTER(curr) = BLOCK_SIZE(curr);
+   BLOCK_NEXT(curr)->size &= ~BLOCK_PREV_INUSE;
+
+   /* A merged _block is only as idle as its newest part */
+   BLOCK_FREE(curr)->purged   = false;
+   BLOCK_FREE(curr)->freed_at = __atomic_load_n(&purge_epoch, __ATOMIC_RELAXED);
+
+   freeListInsert(a, curr);
+}
+
+/*
+ * \brief topRetire
+ *
+ * Closes the arena's newest segment when the next top chunk does not
+ * continue it.  What is left of the top chunk becomes a free _block with
+ * a fence after it, or is abandoned behind the top header, which then
+ * serves as the fence, if too small to hold a _block.
+ */
+static void topRetire(struct _arena *a)
+{
+   if (a->region_top == NULL)
+   {
+      return;
+   }
+
+   size_t left = a->region_end - a->region_top;
+   if (left < 2 * sizeof(struct _block) + MIN_BLOCK_SIZE)
+   {
+      return;
+   }
+
+   struct _block *b     = (struct _block *)a->region_top;
+   struct _block *fence = (struct _block *)(a->region_end - sizeof(struct _block));
+
+   b->size     = (left - 2 * sizeof(struct _block)) | BLOCK_INUSE |
+                 (b->size & BLOCK_PREV_INUSE);
+   fence->size = BLOCK_INUSE | BLOCK_PREV_INUSE;
+   a->segment_last->end = fence;
+
+   a->num_blocks++;
+   heapResize(a, left - sizeof(struct _block));
+   blockRelease(a, b);
+}
+
+/*
+ * \brief segmentStart
+ *
+ * Opens a new segment at base and makes it the arena's newest, with an
+ * empty top chunk right after the segment header.
+ */
+static void segmentStart(struct _arena *a, char *base)
+{
+   struct _segment *seg = (struct _segment *)base;
+   seg->arena = a;
+   seg->next  = NULL;
+   seg->end   = SEGMENT_FIRST(seg);
+   seg->end->size = BLOCK_INUSE | BLOCK_PREV_INUSE;
+
+   if (a->segment_last)
+   {
+      a->segment_last->next = seg;
+   }
+   else
+   {
+      a->segments = seg;
+   }
+   a->segment_last = seg;
+   a->region_top   = (char *)seg->end;
+}
+
+/*
+ * \brief countGrow
+ *
+ * Counts a trip to the OS for more heap.
+ */
+static void countGrow(struct _arena *a)
+{
+    /* Skip first allocation (for atexit) for grows count */
+    if (a != &arenas[0] || (!first_allocation && !in_printStatistics)) {
+        a->num_grows++;
+    } else {
+        first_allocation = false;
+    }
+}
+
+/*
+ * \brief sbrkRefill
+ *
+ * Extends the main arena's top chunk with sbrk.  Each call asks for
+ * twice as much as the last, up to HEAP_GROW_MAX, so a burst of
+ * allocations costs a handful of system calls instead of one each.
+ *
+ * \return true if the top chunk now holds at least bytes
+ */
+static bool sbrkRefill(struct _arena *a, size_t bytes)
+{
+   /* Leave room to open a new segment, should that be needed */
+   bytes += SEGMENT_HEADER_SIZE + ALIGNMENT;
+
+   size_t chunk = a->grow_size ? a->grow_size : HEAP_GROW_MIN;
+   if (chunk < bytes)
+   {
+      chunk = (bytes + HEAP_GROW_MIN - 1) & ~(size_t)(HEAP_GROW_MIN - 1);
+   }
+
+   /* Request more space from OS, keeping the break aligned */
+   char *curr = sbrk(0);
+   chunk += -((uintptr_t)curr + chunk) & (ALIGNMENT - 1);
+   char *prev = sbrk(chunk);
+
+   if (prev == (char *)-1)
+   {
+      return false;
+   }
+   assert(curr == prev);
+
+   if (heap_start == NULL)
    {
-      *last = curr;
-      curr  = curr->next;
+      __atomic_store_n(&heap_start, curr, __ATOMIC_RELEASE);
    }
-   return curr;
-#endif
+   __atomic_store_n(&heap_end, curr + chunk, __ATOMIC_RELEASE);
 
-// \TODO Put your Best Fit code in this #ifdef block
-#if defined BEST && BEST == 0
-   /** \TODO Implement best fit here */
-   /* Best fit */
-   struct _block *best = NULL;
-   size_t min_size = (size_t)-1;  // Initialize to maximum possible size
-   while (curr)
+   /* Somebody else moved the break, the old top cannot be extended */
+   if (curr != a->region_end)
    {
-       if (curr->free && curr->size >= size)
-       {
-           if (curr->size < min_size) 
-           {
-               min_size = curr->size;
-               best = curr;
-           }
-       }
-       *last = curr;
-       curr = curr->next;
+      topRetire(a);
+      segmentStart(a, (char *)ALIGN16((uintptr_t)curr));
    }
-   return best;
-#endif
+   a->region_end = curr + chunk;
 
-// \TODO Put your Worst Fit code in this #ifdef block
-#if defined WORST && WORST == 0
-   /** \TODO Implement worst fit here */
-   /* Worst fit */
-   struct _block *worst = NULL;
-   size_t max_size = 0;
-   while (curr)
+   a->grow_size = chunk < HEAP_GROW_MAX / 2 ? chunk * 2 : HEAP_GROW_MAX;
+   countGrow(a);
+   return true;
+}
+
+/*
+ * \brief regionRefill
+ *
+ * Replaces the arena's top chunk with a fresh REGION_SIZE aligned mmap
+ * region.  The pages are reserved, not committed, so the whole region
+ * serves as the top chunk from the start.
+ *
+ * \return true if the top chunk now holds at least bytes
+ */
+static bool regionRefill(struct _arena *a, size_t bytes)
+{
+   if (bytes > REGION_SIZE - SEGMENT_HEADER_SIZE)
    {
-       if (curr->free && curr->size >= size)
-       {   
-           if (curr->size > max_size) 
-           {
-               max_size = curr->size;
-               worst = curr;
-           }
-       }
-       *last = curr;
-       curr = curr->next;
+      return false;
    }
-   return worst;
-#endif
 
-// \TODO Put your Next Fit code in this #ifdef block
-#if defined NEXT && NEXT == 0
-   /** \TODO Implement next fit here */
-   /* Next fit */
-   if (!curr) {
-       return NULL;  // Empty heap
+   /* Over-map so an aligned region fits, then trim both ends */
+   char *map = mmap(NULL, 2 * REGION_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (map == MAP_FAILED)
+   {
+      return false;
    }
-   
-   /* Start from last allocated if it exists, otherwise start from beginning */
-   if (last_allocated) {
-       curr = last_allocated->next;
-       if (!curr) {
-           curr = heapList;  // Wrap to beginning if at end
-       }
+   char *base = (char *)(((uintptr_t)map + REGION_SIZE - 1) & ~(REGION_SIZE - 1));
+   if (base > map)
+   {
+      munmap(map, base - map);
    }
+   munmap(base + REGION_SIZE, map + REGION_SIZE - base);
 
-   /* Save starting point */
-   struct _block *start = curr;
-   
-   /* Search once through the list */
-   do {
-       if (curr->free && curr->size >= size) {
-           last_allocated = curr;  // Update last allocated
-           return curr;
-       }
-       *last = curr;
-       curr = curr->next;
-       if (!curr) {
-           curr = heapList;  // Wrap around
-       }
-   } while (curr != start);
-
-   /* If we get here, we've searched the entire list and found nothing */
-   return NULL;
-#endif
+   topRetire(a);
+   segmentStart(a, base);
+   a->region_end = base + REGION_SIZE;
 
-   return curr;
+   countGrow(a);
+   return true;
 }
 
 /*
  * \brief growHeap
  *
- * Given a requested size of memory, use sbrk() to dynamically 
- * increase the data segment of the calling process.  Updates
- * the free list with the newly allocated memory.
+ * Given a requested size of memory, carve a new _block off the arena's
+ * top chunk with a pointer bump.  Only when the top chunk runs short
+ * does the arena go to the OS: the main arena extends it with sbrk(),
+ * the others (and the main arena once sbrk fails) map a new region.
  *
- * \param last tail of the free _block list
+ * \param a the locked arena to grow
  * \param size size in bytes to request from the OS
  *
  * \return returns the newly allocated _block of NULL if failed
  */
-struct _block *growHeap(struct _block *last, size_t size) 
+struct _block *growHeap(struct _arena *a, size_t size) 
 {
-   /* Request more space from OS */
-   struct _block *curr = (struct _block *)sbrk(0);
-   struct _block *prev = (struct _block *)sbrk(sizeof(struct _block) + size);
+   size_t bytes = sizeof(struct _block) + size;
 
-   assert(curr == prev);
+   /* The top chunk keeps room for its own header behind the new _block */
+   if ((size_t)(a->region_end - a->region_top) < bytes + sizeof(struct _block) &&
+       !(a == &arenas[0] && sbrkRefill(a, bytes + sizeof(struct _block))) &&
+       !regionRefill(a, bytes + sizeof(struct _block)))
+   {
+      /* OS allocation failed */
+      return NULL;
+   }
+
+   struct _block *curr = (struct _block *)a->region_top;
+   a->region_top += bytes;
+
+   /* The top header moves up and ends the segment */
+   struct _block *top = (struct _block *)a->region_top;
+   top->size = BLOCK_INUSE | BLOCK_PREV_INUSE;
+   a->segment_last->end = top;
+
+   /* Update _block metadata */
+   curr->size = size | BLOCK_INUSE | (curr->size & BLOCK_PREV_INUSE);
+
+    a->num_blocks++;
+    heapResize(a, bytes);
+   return curr;
+}
+
+/*
+ * \brief mmapBlock
+ *
+ * Maps a dedicated region for a large request, with the payload on an
+ * alignment boundary.  Whole pages the alignment leaves unused at either
+ * end are unmapped again.  The _block is marked mmapped and belongs to
+ * no segment, so neither findFreeBlock nor coalescing can see it.
+ *
+ * \return the new _block or NULL if mmap failed
+ */
+static struct _block *mmapBlock(size_t size, size_t alignment)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   size_t length = (MMAP_HEADER_SIZE + size + page - 1) & ~(size_t)(page - 1);
+   if (alignment > ALIGNMENT)
+   {
+      length += alignment;
+   }
 
-   /* OS allocation failed */
-   if (curr == (struct _block *)-1) 
+   char *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (map == MAP_FAILED)
    {
       return NULL;
    }
 
-    if (heap_start == NULL) 
-    {
-       heap_start = curr;
-    }
+   uintptr_t data  = ((uintptr_t)map + MMAP_HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+   char     *start = (char *)((data - MMAP_HEADER_SIZE) & ~(uintptr_t)(page - 1));
+   char     *end   = (char *)((data + size + page - 1) & ~(uintptr_t)(page - 1));
+   if (start > map)
+   {
+      munmap(map, start - map);
+   }
+   if (map + length > end)
+   {
+      munmap(end, map + length - end);
+   }
+
+   struct _block *curr = BLOCK_HEADER(data);
+   MMAP_OFFSET(curr) = (char *)curr - start;
+   curr->size = (end - (char *)data) | BLOCK_INUSE | BLOCK_MMAPPED;
+   return curr;
+}
 
-   /* Update heapList if not set */
-   if (heapList == NULL) 
+/*
+ * \brief blockShrink
+ *
+ * Cuts an in-use _block down to size bytes.  A tail big enough to be a
+ * _block of its own is split off and released, merging into a free
+ * _block after it.
+ */
+static void blockShrink(struct _arena *a, struct _block *b, size_t size)
+{
+   size_t remaining_size = BLOCK_SIZE(b) - size;
+   if (remaining_size < sizeof(struct _block) + MIN_BLOCK_SIZE)
    {
-      heapList = curr;
-      curr->prev = NULL;
+      return;
    }
 
-   /* Attach new _block to previous _block */
-    if (last) 
-    {
-        last->next = curr;
-        curr->prev = last;
-    }
+   struct _block *tail = (struct _block *)((char *)BLOCK_DATA(b) + size);
+   tail->size = (remaining_size - sizeof(struct _block)) | BLOCK_INUSE | BLOCK_PREV_INUSE;
+   b->size    = size | (b->size & BLOCK_FLAGS);
+
+   a->num_splits++;
+   a->num_blocks++;
+   blockRelease(a, tail);
+}
+
+/*
+ * \brief blockAlloc
+ *
+ * Finds or carves an in-use _block of at least size bytes in the locked
+ * arena.  size is a REQUEST_SIZE no smaller than MIN_BLOCK_SIZE.
+ *
+ * \return the _block or NULL if the heap could not grow
+ */
+static struct _block *blockAlloc(struct _arena *a, size_t size)
+{
+   /* Look for free _block.  If a free block isn't found then we need to grow our heap. */
 
-   /* Update _block metadata:
-      Set the size of the new block and initialize the new block to "free".
-      Set its next pointer to NULL since it's now the tail of the linked list.
+   struct _block *next = findFreeBlock(a, size);
+
+   /* TODO: If the block found by findFreeBlock is larger than we need then:
+        If the leftover space in the new block is greater than the sizeof(_block)+4 then
+        split the block.
+        If the leftover space in the new block is less than the sizeof(_block)+4 then
+        don't split the block.
    */
-   curr->size = size;
-   curr->next = NULL;
-   curr->free = false;
 
-    /* Skip first allocation (for atexit) for grows count */
-    if (!first_allocation && !in_printStatistics) {
-        num_grows++;
-    } else {
-        first_allocation = false;
-    }
-    num_blocks++;
-    
-    /* Update max heap size */
-    if (heapList) {
-        size_t heap_size = 0;
-        struct _block *curr_iter = heapList;
-        while (curr_iter) {
-            heap_size += curr_iter->size;  // Use unaligned size
-            curr_iter = curr_iter->next;
-        }
+  if (next != NULL) {
+    /* If we found a free block */
+    a->num_reuses++;
+    freeListRemove(a, next);
+    blockSplit(a, next, size);
+}
 
-        if (heap_size > max_heap) {
-            max_heap = heap_size;
-        }
-    }
-   return curr;
+   /* Could not find free _block, so grow heap */
+   if (next == NULL) 
+   {
+      next = growHeap(a, size);
+   }
+   return next;
 }
 
 /*
@@ -305,102 +1484,81 @@ struct _block *growHeap(struct _block *last, size_t size)
 void *malloc(size_t size) 
 {
 
-   if( atexit_registered == 0 )
+   if( __atomic_load_n(&atexit_registered, __ATOMIC_ACQUIRE) == 0 )
    {
-      atexit_registered = 1;
-      atexit( printStatistics );
+      mallocInit();
    }
 
-   /* Align to multiple of 4 */
-   size = ALIGN4(size);
-
    /* Handle 0 size */
    if (size == 0) 
    {
       return NULL;
    }
+   if (size > PTRDIFF_MAX)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
 
-   /* Look for free _block.  If a free block isn't found then we need to grow our heap. */
+   /* Large requests get their own mapping, outside any arena lock */
+   if (size >= mmap_threshold && size > SLAB_MAX_SIZE)
+   {
+      struct _block *big = mmapBlock(size, ALIGNMENT);
+      if (big)
+      {
+         struct _arena *a = arenaAcquire();
+         a->num_mallocs++;
+         a->num_requested += size;
+         a->num_mmaps++;
+         pthread_mutex_unlock(&a->lock);
+         return BLOCK_DATA(big);
+      }
+   }
 
-   struct _block *last = heapList;
-   struct _block *next = findFreeBlock(&last, size);
+   struct _arena *a = arenaAcquire();
 
-   /* TODO: If the block found by findFreeBlock is larger than we need then:
-        If the leftover space in the new block is greater than the sizeof(_block)+4 then
-        split the block.
-        If the leftover space in the new block is less than the sizeof(_block)+4 then
-        don't split the block.
-   */
+   /* Small requests are served from slabs when there is room */
+   if (size <= SLAB_MAX_SIZE)
+   {
+      void *slot = slabAlloc(a, size);
+      if (slot)
+      {
+         a->num_mallocs++;
+         a->num_requested += size;
+         pthread_mutex_unlock(&a->lock);
+         return slot;
+      }
+   }
 
-  if (next != NULL) {
-    /* If we found a free block */
-    num_reuses++;
-    
-    /* Check if block is large enough to split */
-    size_t remaining_size = next->size - size;
-    if (remaining_size >= sizeof(struct _block) + 4) {
-        struct _block *new_block = (struct _block *)((char *)next + 
-                                    sizeof(struct _block) + size);
-                                    
-        new_block->size = remaining_size - sizeof(struct _block);
-        new_block->next = next->next;
-        new_block->free = true;
-
-         if (next->next) {
-            next->next->prev = new_block;  // Update next block's prev pointer
-        }
-        
-        
-        next->size = size;
-        next->next = new_block;
-        
-        num_splits++;
-        num_blocks++;
-    }
-}
+   /* Pad so the _block after this one stays aligned too, and make sure
+      the _block can hold its bookkeeping once freed */
+   size = REQUEST_SIZE(size);
+   if (size < MIN_BLOCK_SIZE)
+   {
+      size = MIN_BLOCK_SIZE;
+   }
 
-   /* Could not find free _block, so grow heap */
-   if (next == NULL) 
+   /* Regions cannot hold this, only sbrk can */
+   if (size > REGION_BLOCK_MAX && a != &arenas[0])
    {
-      next = growHeap(last, size);
+      pthread_mutex_unlock(&a->lock);
+      a = &arenas[0];
+      pthread_mutex_lock(&a->lock);
    }
 
+   struct _block *next = blockAlloc(a, size);
+
    /* Could not find free _block or grow heap, so just return NULL */
    if (next == NULL) 
    {
+      pthread_mutex_unlock(&a->lock);
       return NULL;
    }
    
-   /* Mark _block as in use */
-    next->free = false;
-    num_mallocs++;         // Count user mallocs
-    num_requested += size; // Count user requests
-
-    /*update max heap size*/
-    
-    if (heapList) {
-        size_t actual_heap = 0;
-        struct _block *curr_iter = heapList;
-        while (curr_iter) {
-            size_t total_block_size = curr_iter->size + sizeof(struct _block);
-            total_block_size = ALIGN4(total_block_size);
-            actual_heap += total_block_size;
-            curr_iter = curr_iter->next;
-        }
-
-        size_t total_heap = actual_heap;
+    a->num_mallocs++;         // Count user mallocs
+    a->num_requested += size; // Count user requests
 
-        // Include internal allocations (e.g., from printf)
-        size_t internal_allocations = 0;
-        // Add any known internal allocations here, if applicable
-
-        total_heap += internal_allocations;
-
-        if (total_heap > max_heap) {
-            max_heap = total_heap;
-        }
-    }
-    
+   pthread_mutex_unlock(&a->lock);
 
    /* Return data address associated with _block to the user */
    return BLOCK_DATA(next);
@@ -423,38 +1581,42 @@ void free(void *ptr)
       return;
    }
 
-   /* Make _block as free */
+   if (slabOwns(ptr))
+   {
+      struct _arena *a = slabOf(ptr)->arena;
+      pthread_mutex_lock(&a->lock);
+      slabFree(a, ptr);
+      a->num_frees++;
+      pthread_mutex_unlock(&a->lock);
+      return;
+   }
+
+   /* Mapped _blocks go straight back to the OS */
    struct _block *curr = BLOCK_HEADER(ptr);
-   assert(curr->free == 0);
-   curr->free = true;
-   num_frees++;
+   if (curr->size & BLOCK_MMAPPED)
+   {
+      munmap(MMAP_START(curr), MMAP_LENGTH(curr));
+      struct _arena *a = arenaAcquire();
+      a->num_frees++;
+      pthread_mutex_unlock(&a->lock);
+      return;
+   }
+
+   /* Make _block as free */
+   struct _arena *a = blockArena(curr);
+   pthread_mutex_lock(&a->lock);
+   assert(curr->size & BLOCK_INUSE);
+   a->num_frees++;
+   bool purge_start = !purger_started;
    /* TODO: Coalesce free _blocks.  If the next block or previous block 
             are free then combine them with this block being freed.
    */
-    /* Coalesce with previous block first if it's free */
-   if (curr->prev && curr->prev->free)
-   {
-       struct _block *prev_block = curr->prev;
-       prev_block->size += sizeof(struct _block) + curr->size;
-       prev_block->next = curr->next;
-       if (curr->next) {
-           curr->next->prev = prev_block;
-       }
-       curr = prev_block;  // Move curr pointer to coalesced block
-       num_coalesces++;
-       num_blocks--;
-   }
+   blockRelease(a, curr);
+   pthread_mutex_unlock(&a->lock);
 
-   /* Then coalesce with next block if it's free */
-   if (curr->next && curr->next->free)
+   if (purge_start)
    {
-       curr->size += sizeof(struct _block) + curr->next->size;
-       curr->next = curr->next->next;
-       if (curr->next) {
-           curr->next->prev = curr;
-       }
-       num_coalesces++;
-       num_blocks--;
+      purgerStart();
    }
 }
 
@@ -484,36 +1646,204 @@ void *realloc( void *ptr, size_t size )
         return NULL;
     }
 
+    if (slabOwns(ptr))
+    {
+        struct _slab *slab = slabOf(ptr);
+        if (slab->slot_size >= size)
+        {
+            return ptr;
+        }
+
+        void *new_ptr = malloc(size);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, slab->slot_size);
+            pthread_mutex_lock(&slab->arena->lock);
+            slabFree(slab->arena, ptr);
+            pthread_mutex_unlock(&slab->arena->lock);
+        }
+        return new_ptr;
+    }
+
     struct _block *curr = BLOCK_HEADER(ptr);
-    size_t current_size = curr->size;
+    size_t current_size = BLOCK_SIZE(curr);
 
     if (current_size >= size)
     {
         return ptr;
     }
 
+    /* Let the kernel move the pages of a mapped _block, nothing is copied */
+    if ((curr->size & BLOCK_MMAPPED) && size >= mmap_threshold)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t offset = MMAP_OFFSET(curr);
+        size_t length = (offset + sizeof(struct _block) + size + page - 1) & ~(size_t)(page - 1);
+        char *moved = mremap(MMAP_START(curr), MMAP_LENGTH(curr), length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED)
+        {
+            return NULL;
+        }
+        curr = (struct _block *)(moved + offset);
+        curr->size = (length - offset - sizeof(struct _block)) | BLOCK_INUSE | BLOCK_MMAPPED;
+        return BLOCK_DATA(curr);
+    }
+
     void *new_ptr = malloc(size);
     if (new_ptr)
     {
         memcpy(new_ptr, ptr, current_size);
-        // Don't increment num_frees since this isn't a user-called free
-        curr->free = true;
-        if (curr->prev && curr->prev->free)
-        {
-            // ... coalescing code ...
-            num_coalesces++;
-            num_blocks--;
-        }
-        if (curr->next && curr->next->free)
+        if (curr->size & BLOCK_MMAPPED)
         {
-            // ... coalescing code ...
-            num_coalesces++;
-            num_blocks--;
+            munmap(MMAP_START(curr), MMAP_LENGTH(curr));
+            return new_ptr;
         }
+        struct _arena *a = blockArena(curr);
+        pthread_mutex_lock(&a->lock);
+        // Don't increment num_frees since this isn't a user-called free
+        blockRelease(a, curr);
+        pthread_mutex_unlock(&a->lock);
     }
     return new_ptr;
 }
 
+/*
+ * \brief memalign
+ *
+ * Allocates size bytes whose address is a multiple of alignment, a power
+ * of two.  Heap requests take a _block with room to slide the payload up
+ * to the boundary.  The slack in front is split off and freed rather
+ * than wasted, and so is whatever is left behind the payload.
+ *
+ * \return the aligned memory or NULL if failed
+ */
+void *memalign(size_t alignment, size_t size)
+{
+   if (alignment <= ALIGNMENT)
+   {
+      return malloc(size);
+   }
+   if (alignment & (alignment - 1))
+   {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   if( __atomic_load_n(&atexit_registered, __ATOMIC_ACQUIRE) == 0 )
+   {
+      mallocInit();
+   }
+
+   if (size == 0)
+   {
+      return NULL;
+   }
+   if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX - size)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   if (size >= mmap_threshold)
+   {
+      struct _block *big = mmapBlock(size, alignment);
+      if (big)
+      {
+         struct _arena *a = arenaAcquire();
+         a->num_mallocs++;
+         a->num_requested += size;
+         a->num_mmaps++;
+         pthread_mutex_unlock(&a->lock);
+         return BLOCK_DATA(big);
+      }
+   }
+
+   size = REQUEST_SIZE(size);
+   if (size < MIN_BLOCK_SIZE)
+   {
+      size = MIN_BLOCK_SIZE;
+   }
+
+   /* Worst case the payload moves past a whole free _block and then up
+      to the next boundary */
+   size_t need = size + alignment + sizeof(struct _block) + MIN_BLOCK_SIZE;
+
+   struct _arena *a = arenaAcquire();
+   if (need > REGION_BLOCK_MAX && a != &arenas[0])
+   {
+      pthread_mutex_unlock(&a->lock);
+      a = &arenas[0];
+      pthread_mutex_lock(&a->lock);
+   }
+
+   struct _block *curr = blockAlloc(a, need);
+   if (curr == NULL)
+   {
+      pthread_mutex_unlock(&a->lock);
+      return NULL;
+   }
+
+   uintptr_t data    = (uintptr_t)BLOCK_DATA(curr);
+   uintptr_t aligned = (data + alignment - 1) & ~(uintptr_t)(alignment - 1);
+   while (aligned != data && aligned - data < sizeof(struct _block) + MIN_BLOCK_SIZE)
+   {
+      aligned += alignment;
+   }
+
+   /* Split off the leading slack as a free _block of its own */
+   if (aligned != data)
+   {
+      struct _block *lead = curr;
+      curr = BLOCK_HEADER(aligned);
+      curr->size = (BLOCK_SIZE(lead) - (aligned - data)) | BLOCK_INUSE;
+      lead->size = (aligned - data - sizeof(struct _block)) |
+                   (lead->size & BLOCK_FLAGS);
+
+      a->num_splits++;
+      a->num_blocks++;
+      blockRelease(a, lead);
+   }
+   blockShrink(a, curr, size);
+
+   a->num_mallocs++;
+   a->num_requested += size;
+   pthread_mutex_unlock(&a->lock);
+
+   return BLOCK_DATA(curr);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+   if (alignment == 0 || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+   {
+      return EINVAL;
+   }
+
+   void *ptr = memalign(alignment, size);
+   if (ptr == NULL && size)
+   {
+      return ENOMEM;
+   }
+   *memptr = ptr;
+   return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+   return memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+   return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   return memalign(page, (size + page - 1) & ~(size_t)(page - 1));
+}
+
 
 
 /* vim: IENTRTMzMjAgU3ByaW5nIDIwM001= ----------------------------------------*/